@@ -0,0 +1,145 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2019 Mihail Slobodyanuk <slobodyanukma@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* 
+ * File:   prefork.cpp
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "rpc.hpp"
+#include "rpc_streams.hpp"
+#include "rpc_prefork.hpp"
+#include "my_interface.h"
+
+//Pause like page fault or noisy neighbour on every 50th call in the worker
+
+int sometimes_slow_double(int x) {
+	static int calls = 0;
+	if (++calls % 50 == 0) {
+		usleep(20000);
+	}
+	return x * 2;
+}
+
+//Client and workers must register calls in the same order
+
+template<class Ipc>
+auto make_my_rpc(Ipc&& ipc) {
+	return rpc::make_rpc<rpc::stream_serializer>(std::forward<Ipc>(ipc)
+					, no_args
+					, one_arg
+					, many_args
+					//add could be sent to the second worker when the first is slow
+					, rpc::idempotent(add)
+					, rpc::idempotent(sometimes_slow_double)
+					, exit
+					);
+}
+
+void worker() {
+	make_my_rpc(rpc::stdin_stdout_ipc_t()).listen();
+}
+
+void client(const char* self) {
+	//Hedging and balancing need two workers at least
+	size_t size = std::max(2u, std::thread::hardware_concurrency());
+	auto pool = std::make_shared<rpc::prefork_pool_t>(std::vector<std::string>{self, "worker"}, size);
+
+	//Idempotent calls are not hedged until the latency statistics is collected
+	{
+		auto myrpc = make_my_rpc(rpc::prefork_ipc_t(pool));
+		for (size_t i = 0; i + 1 < rpc::prefork_pool_t::hedge_warmup; ++i) {
+			myrpc(add, 1, 2);
+		}
+		if (pool->hedge_stats().hedged != 0) {
+			std::cerr << "hedged during warmup" << std::endl;
+			exit(1);
+		}
+	}
+
+	std::vector<std::thread> threads;
+	std::vector<int> sums(pool->size() * 2);
+	for (size_t t = 0; t < sums.size(); ++t) {
+		threads.emplace_back([&, t] {
+			//rpc_t per thread, workers are shared
+			auto myrpc = make_my_rpc(rpc::prefork_ipc_t(pool));
+			for (int i = 0; i < 1000; ++i) {
+				sums[t] = myrpc(add, sums[t], 1);
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	for (size_t t = 0; t < sums.size(); ++t) {
+		std::cerr << "thread " << t << " sum " << sums[t] << std::endl;
+		if (sums[t] != 1000) {
+			std::cerr << "wrong sum" << std::endl;
+			exit(1);
+		}
+	}
+
+	//Slow calls are sent to the second worker which answers first
+	{
+		auto myrpc = make_my_rpc(rpc::prefork_ipc_t(pool));
+		for (int i = 0; i < 500; ++i) {
+			if (myrpc(sometimes_slow_double, i) != i * 2) {
+				std::cerr << "wrong result" << std::endl;
+				exit(1);
+			}
+		}
+		rpc::hedge_stats_t stats = pool->hedge_stats();
+		if (stats.hedged == 0 || stats.wins == 0) {
+			std::cerr << "slow calls were not hedged" << std::endl;
+			exit(1);
+		}
+	}
+
+	auto myrpc = make_my_rpc(rpc::prefork_ipc_t(pool));
+	myrpc(one_arg, std::string("hello"));
+	//Worker dies in the call, the pool starts new one instead
+	try {
+		myrpc(exit, 0);
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+	}
+	std::cerr << myrpc(add, 1, 2) << std::endl;
+
+	rpc::hedge_stats_t stats = pool->hedge_stats();
+	std::cerr << "calls " << stats.calls << " hedged " << stats.hedged << " wins " << stats.wins << std::endl;
+}
+
+int main(int, char* argv[]) {
+	if (argv[1] && strcmp(argv[1], "worker") == 0) {
+		worker();
+	} else {
+		client(argv[0]);
+	}
+	return 0;
+}
@@ -31,8 +31,13 @@
 #ifndef RPC_HPP
 #define RPC_HPP
 
+#include <array>
+#include <cstdint>
+#include <stdexcept>
 #include <string>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 
 namespace rpc {
 
@@ -42,10 +47,16 @@ namespace rpc {
 		struct func_meta_t {
 			typedef ReturnType(*func_type)(ArgsType...);
 
-			func_meta_t(func_type f)
-			: m_address(f) {
+			func_meta_t(func_type f, bool idempotent = false)
+			: m_address(f), m_idempotent(idempotent) {
 			}
 			func_type m_address;
+			bool m_idempotent;
+		};
+
+		template<class R, class... A>
+		struct idempotent_t {
+			R(*m_address)(A...);
 		};
 
 		template<class R, class... A>
@@ -53,10 +64,95 @@ namespace rpc {
 			return func_meta_t<R, A...>(f);
 		}
 
+		template<class R, class... A>
+		func_meta_t<R, A...> make_func_meta(idempotent_t<R, A...> f) {
+			return func_meta_t<R, A...>(f.m_address, true);
+		}
+
 		template <class F, class Tuple, std::size_t... I>
 		constexpr decltype(auto) apply_impl(F&& f, Tuple&& t, std::index_sequence<I...>) {
 			return f(std::get<I>(std::forward<Tuple>(t))...);
 		}
+
+		template<class...>
+		using void_t = void;
+
+		//Function index as it is stored in the fixed layout message header
+		typedef std::uint32_t fixed_index_t;
+
+		//Types which could be transferred by plain copy of their bytes
+
+		//Non-const lvalue reference needs the lvalue, so it is not fixed size
+
+		template<class T>
+		struct is_fixed_size : std::integral_constant<bool, std::is_arithmetic<std::decay_t<T>>::value
+		&& !(std::is_lvalue_reference<T>::value && !std::is_const<std::remove_reference_t<T>>::value)> {
+		};
+
+		template<class... T>
+		struct all_fixed_size : std::true_type {
+		};
+
+		template<class T0, class... T>
+		struct all_fixed_size<T0, T...> : std::integral_constant<bool, is_fixed_size<T0>::value && all_fixed_size<T...>::value> {
+		};
+
+		//Serializer supports fixed layout messages if it declares fixed buffers
+
+		template<class Serializer, class = void>
+		struct has_fixed_layout : std::false_type {
+		};
+
+		template<class Serializer>
+		struct has_fixed_layout<Serializer, void_t<typename Serializer::fixed_ibuffer_t>> : std::true_type {
+		};
+
+		//Ipc could send idempotent calls to several servers and take the first response
+
+		template<class Ipc, class = void>
+		struct has_hedge : std::false_type {
+		};
+
+		template<class Ipc>
+		struct has_hedge<Ipc, void_t<decltype(std::declval<Ipc&>().hedge(std::declval<const std::string&>()))>> : std::true_type {
+		};
+
+		//Ipc could send message right from the caller buffer without std::string
+
+		template<class Ipc, class = void>
+		struct has_raw_send : std::false_type {
+		};
+
+		template<class Ipc>
+		struct has_raw_send<Ipc, void_t<decltype(std::declval<Ipc&>().send(std::declval<const char*>(), std::declval<size_t>()))>> : std::true_type {
+		};
+
+		//Call R(A...) is sent as fixed layout message when serializer supports it
+		//and both result and all arguments are fixed size
+
+		template<class Serializer, class R, class... A>
+		struct is_fixed_layout : std::integral_constant<bool, has_fixed_layout<Serializer>::value
+		&& (std::is_void<R>::value || is_fixed_size<R>::value) && all_fixed_size<A...>::value> {
+		};
+
+		//Offset of the I-th argument in the fixed layout message. Arguments follow function index
+
+		template<std::size_t I, class... A>
+		constexpr std::size_t fixed_offset() {
+			const std::size_t sizes[] = {sizeof (fixed_index_t), sizeof (std::decay_t<A>)...};
+			std::size_t offset = 0;
+			for (std::size_t i = 0; i <= I; ++i) {
+				offset += sizes[i];
+			}
+			return offset;
+		}
+
+		//Whole fixed layout message size
+
+		template<class... A>
+		constexpr std::size_t fixed_size() {
+			return fixed_offset<sizeof...(A), A...>();
+		}
 	}
 
 	template<class Serializer, class Ipc, class ... FuncMetas>
@@ -68,21 +164,19 @@ namespace rpc {
 		typedef std::tuple_size<registry_t> registry_size;
 		ipc_t ipc;
 		const registry_t registry;
+		const std::array<bool, registry_size::value> idempotent_calls;
 
-		rpc_t(FuncMetas&& ... fm) : registry{fm ...}
+		rpc_t(FuncMetas&& ... fm) : registry{fm ...}, idempotent_calls{{fm.m_idempotent ...}}
 		{
 		}
 
-		rpc_t(ipc_t&& ipc, FuncMetas&& ... fm) : ipc{ipc}, registry{fm ...}
+		rpc_t(ipc_t&& ipc, FuncMetas&& ... fm) : ipc{ipc}, registry{fm ...}, idempotent_calls{{fm.m_idempotent ...}}
 		{
 		}
 
 		template<class R, class... A>
 		std::string marshal_strong(R(*f)(A...), A&& ... as) {
-			obuffer_t buffer;
-			buffer << find_function_index(f);
-			append_arguments(buffer, as...);
-			return buffer.str();
+			return marshal_index(find_function_index(f), std::forward<A>(as)...);
 		}
 
 		//Do implicit arguments type conversion if possible
@@ -93,39 +187,148 @@ namespace rpc {
 		}
 
 		std::string invoke(std::string callStr) {
-			ibuffer_t buffer(callStr);
-			size_t functionIndex;
-			buffer >> functionIndex;
-			obuffer_t response;
-			apply_function_by_index(functionIndex, buffer, response);
-			return response.str();
+			return invoke_impl(detail::has_fixed_layout<Serializer>(), callStr);
 		}
 
 		template<class R, class... A, class... A1>
 		R operator()(R(*f)(A...), A1&& ... as) {
-			std::string callStr = marshal_strong(f, std::forward<A>(as)...);
+			return call(detail::is_fixed_layout<Serializer, R, A...>(), f, std::forward<A>(as)...);
+		}
+
+
+		void listen() {
+			while(true) {
+				ipc.send(invoke(ipc.recv()));
+			}
+		}
+	private:
+		//Variable layout call
+
+		template<class R, class... A>
+		R call(std::false_type, R(*f)(A...), A&& ... as) {
+			int index = find_function_index(f);
+			return unmarshal_result<R>(transact(index, marshal_index(index, std::forward<A>(as)...)));
+		}
+
+		//Fixed layout call. Message is built in the stack buffer of known size
+
+		template<class R, class... A>
+		R call(std::true_type, R(*f)(A...), A&& ... as) {
+			typename Serializer::template fixed_obuffer_t<detail::fixed_size<A...>()> buffer;
+			int index = find_function_index(f);
+			buffer.template put<0>(static_cast<detail::fixed_index_t> (index));
+			append_fixed_arguments<A...>(buffer, std::index_sequence_for<A...>(), std::forward<A>(as)...);
+			return unmarshal_fixed_result<R>(transact_fixed(index, buffer));
+		}
+
+		template<class... A>
+		std::string marshal_index(int index, A&& ... as) {
+			obuffer_t buffer;
+			buffer << index;
+			append_arguments(buffer, std::forward<A>(as)...);
+			return buffer.str();
+		}
+
+		std::string transact(int index, const std::string& callStr) {
+			return transact(detail::has_hedge<Ipc>(), index, callStr);
+		}
+
+		std::string transact(std::false_type, int, const std::string& callStr) {
 			ipc.send(callStr);
-			std::string respStr = ipc.recv();
-			//Unmarshall
+			return ipc.recv();
+		}
+
+		//Only idempotent call could be executed twice
+
+		std::string transact(std::true_type, int index, const std::string& callStr) {
+			if (idempotent_calls[index]) {
+				return ipc.hedge(callStr);
+			}
+			return transact(std::false_type(), index, callStr);
+		}
+
+		template<class FixedBuffer>
+		std::string transact_fixed(int index, const FixedBuffer& buffer) {
+			//Hedged call needs the message as string to send it twice
+			if (detail::has_hedge<Ipc>::value && idempotent_calls[index]) {
+				return transact(index, buffer.str());
+			}
+			send_fixed(detail::has_raw_send<Ipc>(), buffer);
+			return ipc.recv();
+		}
+
+		template<class FixedBuffer>
+		void send_fixed(std::true_type, const FixedBuffer& buffer) {
+			ipc.send(buffer.data(), buffer.length());
+		}
+
+		template<class FixedBuffer>
+		void send_fixed(std::false_type, const FixedBuffer& buffer) {
+			ipc.send(buffer.str());
+		}
+
+		template<class R>
+		R unmarshal_result(const std::string& respStr, typename std::enable_if<!std::is_void< R >::value>::type* = 0) {
 			ibuffer_t buffer(respStr);
 			R result;
 			buffer >> result;
 			return result;
 		}
 
-		template<class... A, class... A1>
-		void operator()(void(*f)(A...), A1&& ... as) {
-			std::string callStr = marshal(f, std::forward<A>(as)...);
-			ipc.send(callStr);
-			ipc.recv();
+		template<class R>
+		void unmarshal_result(const std::string&, typename std::enable_if<std::is_void< R >::value>::type* = 0) {
 		}
-		
-		void listen() {
-			while(true) {
-				ipc.send(invoke(ipc.recv()));
+
+		template<class R>
+		R unmarshal_fixed_result(const std::string& respStr, typename std::enable_if<!std::is_void< R >::value>::type* = 0) {
+			typename Serializer::fixed_ibuffer_t buffer(respStr);
+			if (buffer.size() != sizeof (R)) {
+				throw std::runtime_error("bad message size");
 			}
+			return buffer.template get<0, R>();
 		}
-	private:
+
+		template<class R>
+		void unmarshal_fixed_result(const std::string&, typename std::enable_if<std::is_void< R >::value>::type* = 0) {
+		}
+
+		template<class... A, class FixedBuffer, std::size_t... I, class... A1>
+		void append_fixed_arguments(FixedBuffer& buffer, std::index_sequence<I...>, A1&& ... as) {
+			int expand[] = {0, (buffer.template put<detail::fixed_offset<I, A...>()>(static_cast<std::decay_t<A>> (as)), 0)...};
+			(void) expand;
+		}
+
+		std::string invoke_impl(std::false_type, const std::string& callStr) {
+			ibuffer_t buffer(callStr);
+			size_t functionIndex;
+			buffer >> functionIndex;
+			obuffer_t response;
+			apply_function_by_index(functionIndex, buffer, response);
+			return response.str();
+		}
+
+		std::string invoke_impl(std::true_type, const std::string& callStr) {
+			typedef typename Serializer::fixed_ibuffer_t fixed_ibuffer_t;
+			if (!fixed_ibuffer_t::accepts(callStr)) {
+				return invoke_impl(std::false_type(), callStr);
+			}
+			fixed_ibuffer_t buffer(callStr);
+			if (buffer.size() < sizeof (detail::fixed_index_t)) {
+				throw std::runtime_error("bad message size");
+			}
+			return apply_fixed_function_by_index(buffer.template get<0, detail::fixed_index_t>(), buffer);
+		}
+
+		template<class F>
+		static bool is_same_function(F registered, F f) {
+			return registered == f;
+		}
+
+		template<class F, class F1>
+		static bool is_same_function(F, F1) {
+			return false;
+		}
+
 		//Function not found in the registry
 
 		template<std::size_t I = 0, class F >
@@ -136,13 +339,7 @@ namespace rpc {
 		template<std::size_t I = 0, class F >
 		int find_function_index(F f, typename std::enable_if<I < registry_size::value>::type* = 0
 						) {
-			return find_function_index < I + 1 > (f);
-		}
-
-		template<std::size_t I = 0 >
-		int find_function_index(typename std::tuple_element<I, registry_t>::type::func_type f, typename std::enable_if<I < registry_size::value>::type* = 0
-						) {
-			if (std::get<I>(registry).m_address == f) {
+			if (is_same_function(std::get<I>(registry).m_address, f)) {
 				return I;
 			} else {
 				return find_function_index < I + 1 > (f);
@@ -213,6 +410,49 @@ namespace rpc {
 				apply_function_by_index < I + 1 > (i, args, response);
 			}
 		}
+
+		//Fixed layout message addressed to the call with variable layout
+
+		template<class FixedBuffer, class R, class... A>
+		std::string apply_fixed(R(*)(A...), const FixedBuffer&, typename std::enable_if<!detail::is_fixed_layout<Serializer, R, A...>::value>::type* = 0) {
+			throw std::runtime_error("The call has not fixed layout");
+		}
+
+		template<class FixedBuffer, class R, class... A>
+		std::string apply_fixed(R(*f)(A...), const FixedBuffer& args, typename std::enable_if<detail::is_fixed_layout<Serializer, R, A...>::value>::type* = 0) {
+			//Only total length is validated. All fields are read at known offsets
+			if (args.size() != detail::fixed_size<A...>()) {
+				throw std::runtime_error("bad message size");
+			}
+			return apply_fixed(f, args, std::index_sequence_for<A...>());
+		}
+
+		template<class FixedBuffer, class R, class... A, std::size_t... I>
+		std::string apply_fixed(R(*f)(A...), const FixedBuffer& args, std::index_sequence<I...>, typename std::enable_if<!std::is_void< R >::value>::type* = 0) {
+			typename Serializer::template fixed_obuffer_t<sizeof (R)> response;
+			response.template put<0>(f(args.template get<detail::fixed_offset<I, A...>(), std::decay_t<A>>()...));
+			return response.str();
+		}
+
+		template<class FixedBuffer, class R, class... A, std::size_t... I>
+		std::string apply_fixed(R(*f)(A...), const FixedBuffer& args, std::index_sequence<I...>, typename std::enable_if<std::is_void< R >::value>::type* = 0) {
+			f(args.template get<detail::fixed_offset<I, A...>(), std::decay_t<A>>()...);
+			return std::string();
+		}
+
+		template<std::size_t I = 0, class FixedBuffer>
+		std::string apply_fixed_function_by_index(size_t, const FixedBuffer&, typename std::enable_if<I == registry_size::value>::type* = 0) {
+			throw std::out_of_range("The call is not registered");
+		}
+
+		template<std::size_t I = 0, class FixedBuffer>
+		std::string apply_fixed_function_by_index(size_t i, const FixedBuffer& args, typename std::enable_if<I < registry_size::value>::type* = 0) {
+			if (i == I) {
+				return apply_fixed(std::get<I>(registry).m_address, args);
+			} else {
+				return apply_fixed_function_by_index < I + 1 > (i, args);
+			}
+		}
 	};
 
 	namespace detail {
@@ -228,6 +468,14 @@ namespace rpc {
 		}
 	}
 
+	//Marks the call as safe to execute more than once, e.g.
+	//rpc::make_rpc<...>(rpc::idempotent(add), exit)
+
+	template<class R, class... A>
+	detail::idempotent_t<R, A...> idempotent(R(*f)(A...)) {
+		return {f};
+	}
+
 	template<class Serializer, class Ipc, class... F>
 	auto make_rpc(F... f) {
 		return detail::make_rpc_wrapper<Serializer, Ipc>(detail::make_func_meta(f)...);
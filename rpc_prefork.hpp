@@ -0,0 +1,507 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2019 Mihail Slobodyanuk <slobodyanukma@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* 
+ * File:   rpc_prefork.hpp
+ */
+
+#ifndef RPC_PREFORK_HPP
+#define RPC_PREFORK_HPP
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace rpc {
+
+	struct hedge_stats_t {
+		//Idempotent calls
+		size_t calls = 0;
+		//Calls sent to the second worker
+		size_t hedged = 0;
+		//Calls answered by the second worker first
+		size_t wins = 0;
+	};
+
+	//Supervisor of the server worker processes.
+	//Each worker is the same executable started with worker arguments. Its stdin and
+	//stdout are connected to the own socket, so worker just listens with stdin_stdout_ipc_t.
+	//Messages are framed by new line like in the stdin_stdout_ipc_t
+
+	struct prefork_pool_t {
+
+		struct worker_t {
+			pid_t pid = -1;
+			int fd = -1;
+			//Calls sent or waiting for the channel
+			size_t outstanding = 0;
+			//Responses of the abandoned hedged calls to skip
+			size_t stale = 0;
+			//Received bytes after the last message
+			std::string input;
+			//Message being sent. Keeps capacity between calls
+			std::string output;
+			//Held for the whole call: worker processes calls one by one
+			std::mutex channel;
+		};
+
+		prefork_pool_t(const std::vector<std::string>& argv, size_t size)
+		: argv(argv) {
+			if (argv.empty() || size == 0) {
+				throw std::invalid_argument("empty worker command or pool size");
+			}
+			for (size_t i = 0; i < size; ++i) {
+				workers.emplace_back(new worker_t);
+				spawn(*workers.back());
+			}
+		}
+
+		prefork_pool_t(const prefork_pool_t&) = delete;
+		prefork_pool_t& operator=(const prefork_pool_t&) = delete;
+
+		~prefork_pool_t() {
+			for (auto& w : workers) {
+				stop(*w);
+			}
+		}
+
+		size_t size() const {
+			return workers.size();
+		}
+
+		//Pick the worker with the least outstanding calls and take its channel
+
+		size_t acquire() {
+			size_t best = 0;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (size_t i = 1; i < workers.size(); ++i) {
+					if (workers[i]->outstanding < workers[best]->outstanding) {
+						best = i;
+					}
+				}
+				++workers[best]->outstanding;
+			}
+			workers[best]->channel.lock();
+			return best;
+		}
+
+		void release(size_t i) {
+			workers[i]->channel.unlock();
+			std::lock_guard<std::mutex> lock(mutex);
+			--workers[i]->outstanding;
+		}
+
+		//Channel of the worker i must be acquired
+
+		void send(size_t i, const std::string& str) {
+			send(i, str.data(), str.size());
+		}
+
+		void send(size_t i, const char* data, size_t size) {
+			worker_t& w = *workers[i];
+			std::string& message = w.output;
+			message.assign(data, size);
+			message += '\n';
+			size_t sent = write_all(w.fd, message);
+			if (sent == message.size()) {
+				return;
+			}
+			respawn(w);
+			//Worker died while idle and got nothing. Safe to repeat once on the new one
+			if (sent == 0 && write_all(w.fd, message) == message.size()) {
+				return;
+			}
+			respawn(w);
+			throw std::runtime_error("worker process died");
+		}
+
+		std::string recv(size_t i) {
+			worker_t& w = *workers[i];
+			while (!has_line(w)) {
+				if (!read_some(w)) {
+					//The call could have side effects, so it is not repeated
+					respawn(w);
+					throw std::runtime_error("worker process died");
+				}
+			}
+			return pop_line(w);
+		}
+
+		//Hedging: the call is sent to the second worker if the first one has not answered
+		//within the percentile of the recent idempotent calls latency. The first response
+		//wins, the late one is skipped by the next call of that worker
+
+		void set_hedge_percentile(double percentile) {
+			if (!(percentile >= 0 && percentile <= 1)) {
+				throw std::invalid_argument("hedge percentile is out of [0, 1]");
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			hedge_percentile = percentile;
+		}
+
+		hedge_stats_t hedge_stats() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return stats;
+		}
+
+		std::string hedge(const std::string& str) {
+			size_t first = acquire();
+			std::vector<size_t> racing{first};
+			auto start = std::chrono::steady_clock::now();
+			try {
+				send(first, str);
+			} catch (...) {
+				release(first);
+				throw;
+			}
+			std::chrono::nanoseconds delay = hedge_delay();
+			if (delay.count() == 0) {
+				//No latency statistics yet, so plain call
+				std::string line;
+				try {
+					line = recv(first);
+				} catch (...) {
+					release(first);
+					throw;
+				}
+				release(first);
+				record(std::chrono::steady_clock::now() - start, false, false);
+				return line;
+			}
+			auto deadline = start + delay;
+			size_t winner = wait_line(racing, &deadline);
+			bool hedged = false;
+			if (winner == std::string::npos) {
+				size_t second;
+				if (try_acquire_other(first, second)) {
+					try {
+						send(second, str);
+						racing.push_back(second);
+						hedged = true;
+					} catch (...) {
+						//Hedge is optional, keep waiting for the first worker
+						release(second);
+					}
+				}
+				winner = wait_line(racing, NULL);
+			}
+			bool won = hedged && racing[winner] != first;
+			std::string line = pop_line(*workers[racing[winner]]);
+			for (size_t k = 0; k < racing.size(); ++k) {
+				if (k != winner) {
+					abandon(racing[k]);
+				}
+			}
+			release(racing[winner]);
+			record(std::chrono::steady_clock::now() - start, hedged, won);
+			return line;
+		}
+
+		//Samples required before the first hedge
+		static const size_t hedge_warmup = 32;
+
+	private:
+		//Latency samples window of the idempotent calls
+		static const size_t hedge_window = 256;
+		const std::vector<std::string> argv;
+		std::vector<std::unique_ptr<worker_t>> workers;
+		std::mutex mutex;
+		double hedge_percentile = 0.95;
+		std::vector<std::chrono::nanoseconds> latencies;
+		size_t next_latency = 0;
+		//Zero means hedging is off until warmup
+		std::chrono::nanoseconds delay{0};
+		hedge_stats_t stats;
+
+		std::chrono::nanoseconds hedge_delay() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return delay;
+		}
+
+		void record(std::chrono::nanoseconds latency, bool hedged, bool won) {
+			std::lock_guard<std::mutex> lock(mutex);
+			++stats.calls;
+			stats.hedged += hedged;
+			stats.wins += won;
+			if (latencies.size() < hedge_window) {
+				latencies.push_back(latency);
+			} else {
+				latencies[next_latency++ % hedge_window] = latency;
+			}
+			//Percentile is recalculated periodically, not on every call
+			if (stats.calls >= hedge_warmup && stats.calls % (hedge_warmup / 2) == 0) {
+				std::vector<std::chrono::nanoseconds> sorted(latencies);
+				auto nth = sorted.begin() + std::min(sorted.size() - 1, static_cast<size_t> (hedge_percentile * sorted.size()));
+				std::nth_element(sorted.begin(), nth, sorted.end());
+				delay = std::max(*nth, std::chrono::nanoseconds(1));
+			}
+		}
+
+		//Takes channel of the least loaded idle worker other than busy one
+
+		bool try_acquire_other(size_t busy, size_t& other) {
+			std::lock_guard<std::mutex> lock(mutex);
+			std::vector<size_t> order;
+			for (size_t i = 0; i < workers.size(); ++i) {
+				if (i != busy) {
+					order.push_back(i);
+				}
+			}
+			std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+				return workers[a]->outstanding < workers[b]->outstanding;
+			});
+			for (size_t i : order) {
+				if (workers[i]->channel.try_lock()) {
+					++workers[i]->outstanding;
+					other = i;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		//Response of the call is still expected, the worker stays loaded until it arrives
+
+		void abandon(size_t i) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				++workers[i]->outstanding;
+			}
+			++workers[i]->stale;
+			release(i);
+		}
+
+		//Position in the racing of the worker with response, npos on timeout.
+		//Dead worker leaves the racing
+
+		size_t wait_line(std::vector<size_t>& racing, const std::chrono::steady_clock::time_point* deadline) {
+			while (true) {
+				for (size_t k = 0; k < racing.size(); ++k) {
+					if (has_line(*workers[racing[k]])) {
+						return k;
+					}
+				}
+				pollfd fds[2];
+				for (size_t k = 0; k < racing.size(); ++k) {
+					fds[k] = pollfd{workers[racing[k]]->fd, POLLIN, 0};
+				}
+				timespec timeout{0, 0};
+				if (deadline) {
+					auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(*deadline - std::chrono::steady_clock::now());
+					if (left.count() > 0) {
+						timeout.tv_sec = left.count() / 1000000000;
+						timeout.tv_nsec = left.count() % 1000000000;
+					}
+				}
+				int n = ppoll(fds, racing.size(), deadline ? &timeout : NULL, NULL);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n < 0) {
+					for (size_t i : racing) {
+						abandon(i);
+					}
+					racing.clear();
+					throw std::runtime_error("waiting for workers");
+				}
+				if (n == 0) {
+					return std::string::npos;
+				}
+				for (size_t k = racing.size(); k-- > 0;) {
+					if (fds[k].revents && !read_some(*workers[racing[k]])) {
+						respawn(*workers[racing[k]]);
+						release(racing[k]);
+						racing.erase(racing.begin() + k);
+					}
+				}
+				if (racing.empty()) {
+					throw std::runtime_error("worker process died");
+				}
+			}
+		}
+
+		//Skips responses of the abandoned calls. True if the response is received
+
+		bool has_line(worker_t& w) {
+			size_t eol;
+			while ((eol = w.input.find('\n')) != std::string::npos) {
+				if (w.stale == 0) {
+					return true;
+				}
+				w.input.erase(0, eol + 1);
+				--w.stale;
+				std::lock_guard<std::mutex> lock(mutex);
+				--w.outstanding;
+			}
+			return false;
+		}
+
+		std::string pop_line(worker_t& w) {
+			size_t eol = w.input.find('\n');
+			std::string line = w.input.substr(0, eol);
+			w.input.erase(0, eol + 1);
+			return line;
+		}
+
+		//False on end of file or error
+
+		bool read_some(worker_t& w) {
+			char chunk[4096];
+			ssize_t n;
+			while ((n = ::read(w.fd, chunk, sizeof (chunk))) < 0 && errno == EINTR) {
+			}
+			if (n <= 0) {
+				return false;
+			}
+			w.input.append(chunk, n);
+			return true;
+		}
+
+		//Returns count of bytes sent before the error
+
+		static size_t write_all(int fd, const std::string& message) {
+			size_t sent = 0;
+			while (sent < message.size()) {
+				ssize_t n = ::send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n < 0) {
+					break;
+				}
+				sent += n;
+			}
+			return sent;
+		}
+
+		void spawn(worker_t& w) {
+			int sv[2];
+			//Close on exec keeps the channels of the other workers out of the new one
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+				throw std::runtime_error("allocating worker channel");
+			}
+			std::vector<char*> args;
+			for (auto& arg : argv) {
+				args.push_back(const_cast<char*> (arg.c_str()));
+			}
+			args.push_back(NULL);
+
+			pid_t pid = fork();
+			if (pid == 0) {
+				// child continues here
+				if (dup2(sv[1], STDIN_FILENO) == -1 || dup2(sv[1], STDOUT_FILENO) == -1) {
+					_exit(127);
+				}
+				execvp(args[0], args.data());
+				perror("execvp");
+				_exit(127);
+			} else if (pid < 0) {
+				close(sv[0]);
+				close(sv[1]);
+				throw std::runtime_error("failed to create worker");
+			}
+			close(sv[1]);
+			w.pid = pid;
+			w.fd = sv[0];
+			w.input.clear();
+		}
+
+		void stop(worker_t& w) {
+			if (w.pid > 0) {
+				kill(w.pid, SIGTERM);
+			}
+			if (w.fd >= 0) {
+				close(w.fd);
+			}
+			if (w.pid > 0) {
+				while (waitpid(w.pid, NULL, 0) < 0 && errno == EINTR) {
+				}
+			}
+			w.pid = -1;
+			w.fd = -1;
+			std::lock_guard<std::mutex> lock(mutex);
+			w.outstanding -= w.stale;
+			w.stale = 0;
+		}
+
+		void respawn(worker_t& w) {
+			stop(w);
+			spawn(w);
+		}
+	};
+
+	//IPC which sends every call to the least loaded worker of the pool.
+	//rpc_t is not thread safe, so make own rpc_t per thread with the shared pool
+
+	struct prefork_ipc_t {
+		std::shared_ptr<prefork_pool_t> pool;
+		size_t worker = 0;
+
+		prefork_ipc_t(std::shared_ptr<prefork_pool_t> pool) : pool(pool) {
+		}
+
+		void send(std::string str) {
+			send(str.data(), str.size());
+		}
+
+		void send(const char* data, size_t size) {
+			worker = pool->acquire();
+			try {
+				pool->send(worker, data, size);
+			} catch (...) {
+				pool->release(worker);
+				throw;
+			}
+		}
+
+		std::string hedge(const std::string& str) {
+			return pool->hedge(str);
+		}
+
+		std::string recv() {
+			try {
+				std::string result = pool->recv(worker);
+				pool->release(worker);
+				return result;
+			} catch (...) {
+				pool->release(worker);
+				throw;
+			}
+		}
+	};
+}
+
+#endif /* RPC_PREFORK_HPP */
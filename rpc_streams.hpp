@@ -37,6 +37,14 @@
 #include <iomanip>
 #include <memory>
 #include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
 
 namespace rpc {
 
@@ -146,25 +154,233 @@ namespace rpc {
 		}
 	};
 
+	//Fixed layout message is marker followed by hex encoded bytes of the fields.
+	//Hex keeps it free of the line breaks, so it passes through line based ipc
+	static const char fixed_marker = '#';
+
+	template<std::size_t Size>
+	struct fixed_obuffer_t {
+		char chars[1 + 2 * Size];
+
+		fixed_obuffer_t() {
+			chars[0] = fixed_marker;
+		}
+
+		template<std::size_t Offset, class T>
+		void put(const T& t) {
+			static_assert(Offset + sizeof (T) <= Size, "field is out of the message");
+			static const char digits[] = "0123456789ABCDEF";
+			unsigned char bytes[sizeof (T)];
+			std::memcpy(bytes, &t, sizeof (T));
+			char* out = chars + 1 + 2 * Offset;
+			for (size_t i = 0; i < sizeof (T); ++i) {
+				out[2 * i] = digits[bytes[i] >> 4];
+				out[2 * i + 1] = digits[bytes[i] & 0xF];
+			}
+		}
+
+		const char* data() const {
+			return chars;
+		}
+
+		size_t length() const {
+			return sizeof (chars);
+		}
+
+		std::string str() const {
+			return std::string(chars, sizeof (chars));
+		}
+	};
+
+	struct fixed_ibuffer_t {
+		const std::string& in;
+
+		static bool accepts(const std::string& in) {
+			return !in.empty() && in[0] == fixed_marker;
+		}
+
+		fixed_ibuffer_t(const std::string& in) : in(in) {
+		}
+
+		//Size of the fields in bytes. Zero if message is truncated
+		size_t size() const {
+			return in.size() % 2 ? in.size() / 2 : 0;
+		}
+
+		//Caller is responsible to validate size() before
+		template<std::size_t Offset, class T>
+		T get() const {
+			unsigned char bytes[sizeof (T)];
+			const char* src = in.data() + 1 + 2 * Offset;
+			for (size_t i = 0; i < sizeof (T); ++i) {
+				bytes[i] = (nibble(src[2 * i]) << 4) | nibble(src[2 * i + 1]);
+			}
+			T t;
+			std::memcpy(&t, bytes, sizeof (T));
+			return t;
+		}
+
+	private:
+
+		//'0'-'9' and 'A'-'F' without branches
+		static unsigned char nibble(char c) {
+			return (c & 0xF) + (c >> 6) * 9;
+		}
+	};
+
 	struct stream_serializer {
 		using ibuffer_t = rpc::ibuffer_t;
 		using obuffer_t = rpc::obuffer_t;
+		template<std::size_t Size>
+		using fixed_obuffer_t = rpc::fixed_obuffer_t<Size>;
+		using fixed_ibuffer_t = rpc::fixed_ibuffer_t;
+	};
+
+	//Messages queued in the std::cout buffer. Background thread writes them when the
+	//oldest one waits max_delay, so the queue does not wait for a long call handler.
+	//While messages keep coming the thread wakes up every max_delay instead of being
+	//notified per message, that costs few percents of CPU but not the idle latency
+
+	struct stdout_queue_t {
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool queued = false;
+		bool stop = false;
+		//Flusher watches the queue without notification
+		bool armed = false;
+		size_t bytes = 0;
+		std::chrono::steady_clock::time_point deadline;
+		std::chrono::microseconds period{100};
+		std::thread flusher;
+
+		stdout_queue_t() : flusher([this] {
+			run();
+		}) {
+		}
+
+		~stdout_queue_t() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			wake.notify_one();
+			flusher.join();
+		}
+
+		void push(const char* data, size_t size, std::chrono::microseconds max_delay, size_t max_bytes) {
+			std::lock_guard<std::mutex> lock(mutex);
+			std::cout.write(data, size) << '\n';
+			bytes += size + 1;
+			if (bytes >= max_bytes) {
+				flush_locked();
+			} else if (!queued) {
+				queued = true;
+				period = max_delay;
+				deadline = std::chrono::steady_clock::now() + max_delay;
+				//Notification costs the thread switch, so it is only for the sleeping flusher
+				if (!armed) {
+					armed = true;
+					wake.notify_one();
+				}
+			}
+		}
+
+		void flush() {
+			std::lock_guard<std::mutex> lock(mutex);
+			flush_locked();
+		}
+
+	private:
+
+		void flush_locked() {
+			if (bytes) {
+				std::cout.flush();
+			}
+			queued = false;
+			bytes = 0;
+		}
+
+		//Idle periods flusher stays armed after the last queued message
+		static const int armed_periods = 100;
+
+		void run() {
+			std::unique_lock<std::mutex> lock(mutex);
+			int idle = 0;
+			while (!stop) {
+				if (queued) {
+					if (wake.wait_until(lock, deadline) == std::cv_status::timeout
+									&& queued && std::chrono::steady_clock::now() >= deadline) {
+						flush_locked();
+					}
+					idle = 0;
+				} else if (armed && idle < armed_periods) {
+					//Message queued meanwhile has the later deadline than the end of this period
+					wake.wait_for(lock, period);
+					++idle;
+				} else {
+					armed = false;
+					wake.wait(lock);
+					idle = 0;
+				}
+			}
+		}
 	};
 
+	//Sent messages are queued and go by single write when recv() has no buffered
+	//message and is going to wait for the peer, queue reaches max_bytes or the oldest
+	//message waits max_delay. So replies to the requests which peer sent back to back
+	//are written together, and idle peer gets the reply at once. The price is that such
+	//reply could wait up to max_delay more than with flush per message. rpc_t waits
+	//for the reply before the next request, so its messages are still written one by one.
+	//Queue is the std::cout buffer, so it is written at exit() too. stdio writes it out
+	//earlier if its own buffer is smaller than max_bytes
+
 	struct stdin_stdout_ipc_t {
+		std::chrono::microseconds max_delay{100};
+		size_t max_bytes = BUFSIZ;
+		//Shared by copies, started on the first send
+		std::shared_ptr<stdout_queue_t> out;
+		//Received bytes after the last message
+		std::string input;
 
 		void send(std::string str) {
-			//std::cerr << " SENT: " << str << std::endl;
-			std::cout << str << std::endl;
+			send(str.data(), str.size());
+		}
+
+		void send(const char* data, size_t size) {
+			//std::cerr << " SENT: " << std::string(data, size) << std::endl;
+			if (!out) {
+				out = std::make_shared<stdout_queue_t>();
+			}
+			out->push(data, size, max_delay, max_bytes);
+		}
+
+		void flush() {
+			if (out) {
+				out->flush();
+			}
 		}
 
 		std::string recv() {
-			std::string line;
-			char ch = std::cin.get();
-			if (ch != '\n') {
-				std::getline(std::cin, line);
-				line = std::string(1, ch) + line;
+			size_t eol;
+			while ((eol = input.find('\n')) == std::string::npos) {
+				//Going to wait for the peer, so queued messages must go now
+				flush();
+				char chunk[4096];
+				ssize_t n = read(STDIN_FILENO, chunk, sizeof (chunk));
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					//End of input
+					std::string rest;
+					rest.swap(input);
+					return rest;
+				}
+				input.append(chunk, n);
 			}
+			std::string line = input.substr(0, eol);
+			input.erase(0, eol + 1);
 			//std::cerr << " RECV: " << line << std::endl;
 			return line;
 		}